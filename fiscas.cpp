@@ -4,10 +4,26 @@
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+#ifdef __linux__
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#endif
 
 using namespace std;
 
+/* Part of every cache key, so a new assembler never reuses old output */
+const string ASSEMBLER_VERSION = "fiscas 1.1";
+
 /*
    An Instruction is line containing assembly code.
    An assembly code contains labels, comments and operands
@@ -174,58 +190,32 @@ class Assembler {
       vector<AssemblyInstruction> computerInstructions;
       vector<string> hexCode;
 
-   public:
-      /* 
-         This method reads an input file and converts the instructions into
-         into binary representation.
-      */
-      void readData(string path) {
-         firstPass(path);
-         secondPass();
-      }
+      /* Shorter runs are written out word by word even with -r */
+      static const int MIN_RUN_LENGTH = 4;
 
+   public:
       /*
-         The firstPass reads an input file and converts each instruction line
-         into an instruction object. It also keep track of labels and their
-         addresses.
-         It also ouput error such invalid label definitions and use, and out
-         of bound memory storage.
+         readTokens reads an input file and splits every instruction line
+         into its words. Empty lines, whitespace and comments are dropped,
+         so the result is the normalized token stream of the source.
       */
-      void firstPass(string path) {
+      vector<vector<string>> readTokens(string path) {
          ifstream inputFile;
+         vector<vector<string>> tokens;
 
          inputFile.open(path, ios::in);
 
          if (inputFile) {
             string line;
-            int count = 0;
 
             while (getline(inputFile, line)) {
-               if (count > 63) {
-                  cout << "<Output file is larger than system memory>\n";
-                  exit(0);
-               }
-
                if (line.empty()) continue;
                if (isComment(line)) continue;
 
                vector<string> splittedLine = split(line, ' ');
-               Instruction i(splittedLine);
-               instructions.push_back(i);
-
-               string firstWord = splittedLine[0];
-
-               if (firstWord.size() != 0 && isLabel(firstWord)) {
-                  firstWord.erase(firstWord.size() - 1);
-                  
-                  if (labels.find(firstWord) != labels.end()) {
-                     cout << "Label <"<< firstWord << "> on line <";
-                     cout << count << "> is already defined." << endl;
-                     exit(0);
-                  }
-                  labels.emplace(firstWord, count);
-               }
-               count++;
+               if (splittedLine.empty()) continue;
+
+               tokens.push_back(splittedLine);
             }
             inputFile.close();
          }
@@ -233,6 +223,41 @@ class Assembler {
             cout << "<File <" <<path<< "> was not found>\n";
             exit(0);
          }
+         return tokens;
+      }
+
+      /*
+         The firstPass converts each tokenized line into an instruction
+         object. It also keep track of labels and their addresses.
+         It also ouput error such invalid label definitions and use, and out
+         of bound memory storage.
+      */
+      void firstPass(const vector<vector<string>> &tokens) {
+         int count = 0;
+
+         for (auto splittedLine : tokens) {
+            if (count > 63) {
+               cout << "<Output file is larger than system memory>\n";
+               exit(0);
+            }
+
+            Instruction i(splittedLine);
+            instructions.push_back(i);
+
+            string firstWord = splittedLine[0];
+
+            if (firstWord.size() != 0 && isLabel(firstWord)) {
+               firstWord.erase(firstWord.size() - 1);
+               
+               if (labels.find(firstWord) != labels.end()) {
+                  cout << "Label <"<< firstWord << "> on line <";
+                  cout << count << "> is already defined." << endl;
+                  exit(0);
+               }
+               labels.emplace(firstWord, count);
+            }
+            count++;
+         }
       }
 
       /*
@@ -259,29 +284,52 @@ class Assembler {
       }
 
       /*
-         WriteData converts each 8-bit instruction word into hexadecimal
-         and stores the resulting value into an object file, and the 
-         hexCode vector.
+         Returns the object file contents for the assembled instructions.
+         With runLength set, repeated words are written as Logisim's
+         "N*XX" entries.
       */
-      void writeData(string path) {
+      string image(bool runLength = false) {
+         string data = "v2.0 raw\n";
+
+         hexCode.clear();
+         for (auto ci : computerInstructions) {
+            vector<string> word = ci.getWord();
+            string leftHex = binToHex(word[0]+word[1]);
+            string rightHex = binToHex(word[2] + word[3]);
+            string hexLine = "";
+            
+            hexLine.append(leftHex);
+            hexLine.append(rightHex);
+            hexCode.push_back(hexLine);
+         }
+
+         for (size_t i = 0; i < hexCode.size();) {
+            size_t run = 1;
+            while (runLength && i + run < hexCode.size() &&
+               hexCode[i + run] == hexCode[i]) {
+               run++;
+            }
+
+            if (run >= MIN_RUN_LENGTH) {
+               data += to_string(run) + "*" + hexCode[i] + "\n";
+               i += run;
+            }
+            else {
+               data += hexCode[i] + "\n";
+               i++;
+            }
+         }
+         return data;
+      }
+
+      /* Writes object file contents to path */
+      void writeImage(string path, const string &data) {
          ofstream outputFile;
 
          outputFile.open(path, ios::out);
 
          if (outputFile) {
-            outputFile << "v2.0 raw" << endl;
-
-            for (auto ci : computerInstructions) {
-               vector<string> word = ci.getWord();
-               string leftHex = binToHex(word[0]+word[1]);
-               string rightHex = binToHex(word[2] + word[3]);
-               string hexLine = "";
-               
-               hexLine.append(leftHex);
-               hexLine.append(rightHex);
-               outputFile << hexLine << endl;
-               hexCode.push_back(hexLine);
-            }
+            outputFile << data;
             outputFile.close();
          }
          else {
@@ -291,6 +339,21 @@ class Assembler {
          }
       }
 
+      /*
+         Returns the normalized text of a token stream: the assembler
+         version, the output format and the tokens. Edits that only touch
+         comments or whitespace produce the same text.
+      */
+      string tokenText(const vector<vector<string>> &tokens, bool runLength) {
+         string data = ASSEMBLER_VERSION + (runLength ? " -r\n" : "\n");
+
+         for (auto &line : tokens) {
+            for (auto &word : line) data += word + " ";
+            data += "\n";
+         }
+         return data;
+      }
+
       /* This method return a string with a leading 0 for single digits */
       /* and return a string representation of non single digits  */
       string strDig(int d) {
@@ -301,20 +364,20 @@ class Assembler {
       }
 
       /* Displays the listing for -l command option */
-      void displayListing() {
-         cout << "*** LABEL LIST***" << endl;
+      void displayListing(ostream &out = cout) {
+         out << "*** LABEL LIST***" << endl;
          
          unordered_map<string, int>::iterator it = labels.begin();
 
          for (it; it != labels.end(); it++) {
-            cout << setw(8) << left << it->first;
-            cout << setw(4)<< strDig(it->second) << endl;
+            out << setw(8) << left << it->first;
+            out << setw(4)<< strDig(it->second) << endl;
          }
 
-         cout << "*** MACHINE PROGRAM ***" << endl;
+         out << "*** MACHINE PROGRAM ***" << endl;
          for (int i = 0; i < hexCode.size(); i++) {
-            cout << strDig(i) << ":" <<left << setw(5) << hexCode[i];
-            cout <<setw(15)<< instructions[i].toString() << endl;
+            out << strDig(i) << ":" <<left << setw(5) << hexCode[i];
+            out <<setw(15)<< instructions[i].toString() << endl;
          }
       }
 
@@ -384,33 +447,275 @@ class Assembler {
       }
 };
 
+/*
+   The AssemblyCache stores the object file contents and the listing of
+   assembled sources in a directory, one file per cache key:
+
+      fiscas-cache\n<text size>\n<image size>\n<text><image><listing>
+
+   The token text is kept so a hash collision is never taken for a hit.
+
+   Entries are written to a temporary file and renamed, so a reader
+   never sees a partially written entry.
+*/
+class AssemblyCache {
+   private:
+      string dir;
+
+      string entryPath(string key) { return dir + "/" + key + ".fcache"; }
+
+      /* Returns the cache key of a token text, its FNV-1a hash */
+      string cacheKey(const string &data) {
+         uint64_t hash = 0xCBF29CE484222325ULL;
+         char key[17];
+
+         for (unsigned char c : data) {
+            hash ^= c;
+            hash *= 0x100000001B3ULL;
+         }
+         snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+         return key;
+      }
+
+   public:
+      AssemblyCache(string dir) : dir(dir) {
+#ifdef _WIN32
+         _mkdir(dir.c_str());
+#else
+         mkdir(dir.c_str(), 0755);
+#endif
+      }
+
+      /* Loads the entry for a token text, returns false if there is none */
+      bool load(const string &text, string &image, string &listing) {
+         string path = entryPath(cacheKey(text));
+         ifstream inputFile(path, ios::in | ios::binary);
+         string magic, textLine, sizeLine;
+
+         if (!inputFile) return false;
+         if (!getline(inputFile, magic) || magic != "fiscas-cache") {
+            return false;
+         }
+         if (!getline(inputFile, textLine)) return false;
+         if (!getline(inputFile, sizeLine)) return false;
+
+         size_t textSize = strtoul(textLine.c_str(), nullptr, 10);
+         size_t size = strtoul(sizeLine.c_str(), nullptr, 10);
+         stringstream data;
+         data << inputFile.rdbuf();
+
+         string rest = data.str();
+         if (textSize != text.size() || rest.size() < textSize + size) {
+            return false;
+         }
+         if (rest.compare(0, textSize, text) != 0) return false;
+
+         image = rest.substr(textSize, size);
+         listing = rest.substr(textSize + size);
+         return true;
+      }
+
+      /* Stores an entry, silently giving up if the directory is unusable */
+      void store(const string &text, const string &image,
+         const string &listing) {
+         string path = entryPath(cacheKey(text));
+         string temp = path + "." + to_string(getpid()) + ".tmp";
+         ofstream outputFile(temp, ios::out | ios::binary);
+
+         if (!outputFile) return;
+         outputFile << "fiscas-cache\n" << text.size() << "\n";
+         outputFile << image.size() << "\n" << text << image << listing;
+         outputFile.close();
+
+         if (!outputFile || rename(temp.c_str(), path.c_str()) != 0) {
+            remove(temp.c_str());
+         }
+      }
+};
+
+/*
+   Assembles one source file into an object file. With a cache directory
+   an unchanged token stream reuses the stored image and listing and
+   skips both passes.
+*/
+void assembleFile(string source, string object, bool showListing,
+   bool runLength, string cacheDir) {
+   Assembler assembler;
+   vector<vector<string>> tokens = assembler.readTokens(source);
+   string text = assembler.tokenText(tokens, runLength);
+   string image, listing;
+
+   if (cacheDir != "" && AssemblyCache(cacheDir).load(text, image, listing)) {
+      assembler.writeImage(object, image);
+      if (showListing) cout << listing;
+      return;
+   }
+
+   assembler.firstPass(tokens);
+   assembler.secondPass();
+   image = assembler.image(runLength);
+   assembler.writeImage(object, image);
+
+   stringstream listingStream;
+   assembler.displayListing(listingStream);
+   listing = listingStream.str();
+
+   if (cacheDir != "") AssemblyCache(cacheDir).store(text, image, listing);
+   if (showListing) cout << listing;
+}
+
+/* Watch mode needs fork and inotify, so it is only built on Linux */
+#ifdef __linux__
+
+/*
+   Assembles a source in a child process. The assembler exits on the
+   first error, and this keeps such an error from ending the watch.
+*/
+void assembleInChild(string source, string object, bool showListing,
+   bool runLength, string cacheDir) {
+   cout.flush();
+   pid_t pid = fork();
+
+   if (pid == 0) {
+      assembleFile(source, object, showListing, runLength, cacheDir);
+      exit(0);
+   }
+   if (pid > 0) waitpid(pid, nullptr, 0);
+}
+
+/* Returns the directory part of a path */
+string dirName(string path) {
+   size_t slash = path.find_last_of('/');
+
+   if (slash == string::npos) return ".";
+   if (slash == 0) return "/";
+   return path.substr(0, slash);
+}
+
+/* Returns the file name part of a path */
+string baseName(string path) {
+   size_t slash = path.find_last_of('/');
+   return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+/*
+   Watch mode assembles every source once and then waits on inotify for
+   writes to them. The directories are watched rather than the files
+   because editors often replace a file by renaming a new one over it.
+   Only the sources that changed are assembled again. Events are matched
+   on the watch descriptor, which inotify shares between every spelling
+   of the same directory.
+*/
+void watchFiles(vector<string> files, bool showListing, bool runLength,
+   string cacheDir) {
+   int fd = inotify_init();
+   vector<int> watches;
+
+   if (fd < 0) {
+      cout << "<Could not start watching the source files>" << endl;
+      exit(0);
+   }
+
+   for (size_t i = 0; i < files.size(); i += 2) {
+      string dir = dirName(files[i]);
+      int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+
+      if (wd < 0) {
+         cout << "<Could not watch <" << dir << ">>" << endl;
+         exit(0);
+      }
+      watches.push_back(wd);
+      assembleInChild(files[i], files[i + 1], showListing, runLength,
+         cacheDir);
+   }
+
+   char buffer[4096] __attribute__((aligned(__alignof__(inotify_event))));
+
+   while (true) {
+      ssize_t size = read(fd, buffer, sizeof(buffer));
+      if (size <= 0) break;
+
+      for (char *p = buffer; p < buffer + size;) {
+         inotify_event *event = (inotify_event*)p;
+         p += sizeof(inotify_event) + event->len;
+
+         if (event->len == 0) continue;
+
+         for (size_t i = 0; i < files.size(); i += 2) {
+            if (watches[i / 2] == event->wd &&
+               baseName(files[i]) == event->name) {
+               cout << "<Reassembling <" << files[i] << ">>" << endl;
+               assembleInChild(files[i], files[i + 1], showListing,
+                  runLength, cacheDir);
+            }
+         }
+      }
+   }
+}
+
+#endif
+
 /* Prints error message for invalid command operstions */
 void errorMessage() {
-   cout << "USAGE:  fiscas <source file> <object file> [-l]\n";
-   cout << "        -l : print listing to standard error" << endl;
+   cout << "USAGE:  fiscas <source file> <object file> [-l] [-r] ";
+   cout << "[-c <dir>]\n";
+#ifdef __linux__
+   cout << "        fiscas -w <source file> <object file> [...] [-l] [-r] ";
+   cout << "[-c <dir>]\n";
+#endif
+   cout << "        -l : print listing to standard error\n";
+   cout << "        -r : write repeated words as run-length N*XX entries\n";
+   cout << "        -c : reuse the output cached in <dir> for sources whose\n";
+   cout << "             tokens did not change\n";
+#ifdef __linux__
+   cout << "        -w : reassemble each source whenever it changes, also\n";
+   cout << "             accepted as --watch" << endl;
+#endif
    exit(0);
 }
 
 int main(int argc, char** argv) {
    bool showListing = false;
+   bool watch = false;
+   bool runLength = false;
+   string cacheDir = "";
+   vector<string> files;
 
-   if (argc < 3 || argc > 4) {
-      errorMessage();
-   }
-   else if (argc == 4) {
-      string input = argv[3];
+   for (int i = 1; i < argc; i++) {
+      string input = argv[i];
 
       if (input == "-l") {
          showListing = true;
       }
-      else {
+      else if (input == "-r") {
+         runLength = true;
+      }
+#ifdef __linux__
+      else if (input == "-w" || input == "--watch") {
+         watch = true;
+      }
+#endif
+      else if (input == "-c" && i + 1 < argc) {
+         cacheDir = argv[++i];
+      }
+      else if (input.size() > 0 && input[0] == '-') {
          errorMessage();
       }
+      else {
+         files.push_back(input);
+      }
    }
 
-   Assembler assembler;
+   if (files.size() < 2 || files.size() % 2 != 0 ||
+      (!watch && files.size() != 2)) {
+      errorMessage();
+   }
 
-   assembler.readData(argv[1]);
-   assembler.writeData(argv[2]);
-   if (showListing) assembler.displayListing();
-}
\ No newline at end of file
+#ifdef __linux__
+   if (watch) {
+      watchFiles(files, showListing, runLength, cacheDir);
+      return 0;
+   }
+#endif
+   assembleFile(files[0], files[1], showListing, runLength, cacheDir);
+}
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <iomanip>
 #include <stdlib.h>
 #include <cstdio>
 #include <fstream>
@@ -8,6 +9,27 @@
 #include <cstdint>
 #include <vector>
 #include <map>
+#include <functional>
+#include <list>
+#include <queue>
+#include <memory>
+#include <unordered_map>
+#include <cstring>
+#include <climits>
+#ifdef __linux__
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <csignal>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <cerrno>
+#include <chrono>
+#endif
 
 using namespace std;
 
@@ -17,24 +39,13 @@ private:
    uint8_t im[8] = {};
 
 public:
-   /* Initializes the instruction memory using an input binary string */
-   InstructionMemory(string inst) {
-      int index = 0;
-
-      for (auto i : inst) {
-         if (i == '1') {
-            im[index] = 1;
-         }
-         else {
-            im[index] = 0;
-         }
-         index++;
+   /* Initializes the instruction memory from an instruction word */
+   InstructionMemory(uint8_t word) {
+      for (int i = 0; i < 8; i++) {
+         im[i] = (word >> (7 - i)) & 1;
       }
    }
 
-   /* Returns 8-bit array instruction memory */
-   uint8_t* getIM() { return im; }
-
    /* Converts the uint8_t instruction into string */
    string toString() {
       string str = "";
@@ -112,67 +123,720 @@ public:
    }
 
    /* Returns a vector containing each assembly word */
-   vector<string> getDI() { 
+   vector<string> getDI() const { 
       vector<string> vec;
       for (int i = 0; i < 4; i++) vec.push_back(word[i]);
       return vec;
    }
 };
 
+/*
+   A DecodedInstruction holds an 8-bit instruction word split into small
+   integer fields so it can be executed without any string handling.
+   The word is stored in the order Op Rn Rm Rd, and bnz uses the six
+   least significant bits as its target address.
+*/
+struct DecodedInstruction {
+   uint8_t op;
+   uint8_t rd;
+   uint8_t rn;
+   uint8_t rm;
+   uint8_t target;
+
+   DecodedInstruction(uint8_t word) {
+      op = word >> 6;
+      rn = (word >> 4) & 3;
+      rm = (word >> 2) & 3;
+      rd = word & 3;
+      target = word & 63;
+   }
+};
+
+/*
+   The BlockCache memoizes the execution of basic blocks. A basic block
+   starts at some PC and runs up to and including the next bnz. Given the
+   block start and the entry state (Z, R0-R3) the result is always the
+   same, so the cache maps it to the exit state, exit PC and the number of
+   cycles the block consumed.
+   It is a bounded open-addressing table: a key may only live in a small
+   probe window, and when that window is full the least recently used
+   entry of the window is evicted.
+*/
+class BlockCache {
+public:
+   struct Entry {
+      bool used = false;
+      uint64_t pc = 0;
+      uint64_t state = 0;
+      uint64_t exitPC = 0;
+      uint64_t exitState = 0;
+      int cycles = 0;
+      uint64_t lastUse = 0;
+   };
+
+private:
+   static const int PROBE_WINDOW = 8;
+   vector<Entry> table;
+   uint64_t clock = 0;
+   uint64_t lookups = 0, hits = 0, inserts = 0, evictions = 0;
+
+   size_t slotFor(uint64_t pc, uint64_t state) {
+      uint64_t h = state ^ ((uint64_t)pc << 40) ^ 0x9E3779B97F4A7C15ULL;
+      h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+      h = h ^ (h >> 31);
+      return h & (table.size() - 1);
+   }
+
+public:
+   /* The capacity is rounded up to a power of two */
+   BlockCache(size_t capacity) {
+      size_t size = PROBE_WINDOW;
+      while (size < capacity) size *= 2;
+      table.resize(size);
+   }
+
+   /* Returns the entry for a block and entry state, or null on a miss */
+   Entry* find(uint64_t pc, uint64_t state) {
+      lookups++;
+      size_t slot = slotFor(pc, state);
+
+      for (int i = 0; i < PROBE_WINDOW; i++) {
+         Entry &e = table[(slot + i) & (table.size() - 1)];
+
+         /* Slots are never emptied, so the key cannot be further along */
+         if (!e.used) break;
+         if (e.pc == pc && e.state == state) {
+            hits++;
+            e.lastUse = ++clock;
+            return &e;
+         }
+      }
+      return nullptr;
+   }
+
+   /* Stores a block result, evicting the oldest entry of a full window */
+   void insert(uint64_t pc, uint64_t state, uint64_t exitPC,
+      uint64_t exitState, int cycles) {
+      size_t slot = slotFor(pc, state);
+      Entry *victim = nullptr;
+
+      for (int i = 0; i < PROBE_WINDOW; i++) {
+         Entry &e = table[(slot + i) & (table.size() - 1)];
+
+         if (!e.used || (e.pc == pc && e.state == state)) {
+            victim = &e;
+            break;
+         }
+         if (victim == nullptr || e.lastUse < victim->lastUse) victim = &e;
+      }
+
+      if (victim->used && (victim->pc != pc || victim->state != state)) {
+         evictions++;
+      }
+      victim->used = true;
+      victim->pc = pc;
+      victim->state = state;
+      victim->exitPC = exitPC;
+      victim->exitState = exitState;
+      victim->cycles = cycles;
+      victim->lastUse = ++clock;
+      inserts++;
+   }
+
+   /* Displays the lookup, hit and eviction counts */
+   void displayStats(ostream &out) {
+      double rate = lookups == 0 ? 0.0 : 100.0 * hits / lookups;
+      out << dec << "Block cache: lookups:" << lookups << " hits:" << hits;
+      out << " misses:" << lookups - hits << " hit rate:";
+      out << fixed << setprecision(1) << rate << "%";
+      out << " evictions:" << evictions << " entries:" << inserts - evictions;
+      out << endl;
+   }
+};
+
+/*
+   A BranchPredictor guesses the direction of a bnz when it is fetched and
+   is told the real direction once the branch resolves. New predictors
+   only need to implement these two methods and be added to
+   makePredictor.
+*/
+class BranchPredictor {
+public:
+   virtual ~BranchPredictor() {}
+   virtual bool predict(uint64_t PC, uint64_t target) = 0;
+   virtual void update(uint64_t PC, bool taken) = 0;
+};
+
+/* Predicts backward branches taken and forward branches not taken */
+class StaticPredictor : public BranchPredictor {
+public:
+   bool predict(uint64_t PC, uint64_t target) override { return target <= PC; }
+   void update(uint64_t, bool) override {}
+};
+
+/* Remembers the last direction of each branch */
+class OneBitPredictor : public BranchPredictor {
+private:
+   vector<bool> last = vector<bool>(1024, true);
+
+public:
+   bool predict(uint64_t PC, uint64_t) override {
+      return last[PC & 1023];
+   }
+
+   void update(uint64_t PC, bool taken) override { last[PC & 1023] = taken; }
+};
+
+/* Uses a 2-bit saturating counter per branch, starting weakly taken */
+class TwoBitPredictor : public BranchPredictor {
+private:
+   vector<uint8_t> counters = vector<uint8_t>(1024, 2);
+
+public:
+   bool predict(uint64_t PC, uint64_t) override {
+      return counters[PC & 1023] >= 2;
+   }
+
+   void update(uint64_t PC, bool taken) override {
+      uint8_t &c = counters[PC & 1023];
+      if (taken && c < 3) c++;
+      if (!taken && c > 0) c--;
+   }
+};
+
+/*
+   The gshare predictor indexes its 2-bit counters with the PC xor'ed
+   with a global history of the last branch directions.
+*/
+class GsharePredictor : public BranchPredictor {
+private:
+   int historyBits;
+   unsigned history = 0;
+   vector<uint8_t> counters;
+
+   unsigned index(uint64_t PC) {
+      return (PC ^ history) & ((1u << historyBits) - 1);
+   }
+
+public:
+   GsharePredictor(int historyBits) : historyBits(historyBits),
+      counters(1u << historyBits, 2) {}
+
+   bool predict(uint64_t PC, uint64_t) override {
+      return counters[index(PC)] >= 2;
+   }
+
+   void update(uint64_t PC, bool taken) override {
+      uint8_t &c = counters[index(PC)];
+      if (taken && c < 3) c++;
+      if (!taken && c > 0) c--;
+      history = ((history << 1) | (taken ? 1 : 0)) & ((1u << historyBits) - 1);
+   }
+};
+
+/* Creates the predictor with the given name, or null if it is unknown */
+unique_ptr<BranchPredictor> makePredictor(string name) {
+   if (name == "static") return make_unique<StaticPredictor>();
+   if (name == "1bit") return make_unique<OneBitPredictor>();
+   if (name == "2bit") return make_unique<TwoBitPredictor>();
+   if (name == "gshare") return make_unique<GsharePredictor>(8);
+   return nullptr;
+}
+
+/*
+   The PipelineModel is the timing model of a classic 5-stage pipeline
+   (IF ID EX MEM WB). It is fed every instruction the functional
+   simulator retires, so architectural results are always those of the
+   Simulator and only the timing is modeled here.
+   Each instruction's EX cycle is the cycle after the previous one,
+   delayed until its source registers (or Z, for bnz) are available.
+   With forwarding a result can be used by the next instruction's EX,
+   without it the consumer has to read it in ID during the producer's WB.
+   Branches resolve in EX, so a misprediction flushes the two younger
+   instructions in IF and ID. A correctly predicted taken branch costs
+   nothing since the target is part of the instruction.
+*/
+class PipelineModel {
+private:
+   struct BranchStats {
+      long long correct = 0;
+      long long total = 0;
+   };
+
+   static const int MISPREDICT_PENALTY = 2;
+
+   unique_ptr<BranchPredictor> predictor;
+   string predictorName;
+   bool forwarding;
+
+   /* Earliest EX cycle at which R0-R3 and Z (index 4) can be read */
+   long long readyAt[5] = {0, 0, 0, 0, 0};
+   long long lastEx = 1;
+   long long penalty = 0;
+   long long instructions = 0, stalls = 0, flushes = 0;
+   unordered_map<uint64_t, BranchStats> branches;
+
+public:
+   PipelineModel(string predictorName, bool forwarding) :
+      predictor(makePredictor(predictorName)), predictorName(predictorName),
+      forwarding(forwarding) {}
+
+   /* Accounts for one retired instruction */
+   void retire(uint64_t PC, const DecodedInstruction &instruction,
+      bool taken) {
+      long long natural = lastEx + 1 + penalty;
+      long long ex = natural;
+
+      if (instruction.op == 3) {
+         ex = max(ex, readyAt[4]);
+      }
+      else {
+         ex = max(ex, readyAt[instruction.rn]);
+         if (instruction.op != 2) ex = max(ex, readyAt[instruction.rm]);
+      }
+
+      stalls += ex - natural;
+      penalty = 0;
+      instructions++;
+      lastEx = ex;
+
+      if (instruction.op == 3) {
+         BranchStats &stats = branches[PC];
+         bool predicted = predictor->predict(PC, instruction.target);
+
+         predictor->update(PC, taken);
+         stats.total++;
+         if (predicted == taken) {
+            stats.correct++;
+         }
+         else {
+            flushes++;
+            penalty = MISPREDICT_PENALTY;
+         }
+      }
+      else {
+         long long ready = forwarding ? ex + 1 : ex + 3;
+         readyAt[instruction.rd] = ready;
+         readyAt[4] = ready;
+      }
+   }
+
+   /* Displays IPC, stalls, flushes and the accuracy of every branch */
+   void displayStats(ostream &out) {
+      long long cycles = instructions == 0 ? 0 : lastEx + 3;
+      long long correct = 0, total = 0;
+
+      out << dec << fixed << setprecision(3);
+      out << "Pipeline: 5-stage forwarding:" << (forwarding ? "on" : "off");
+      out << " predictor:" << predictorName << endl;
+      out << "Instructions:" << instructions << " Cycles:" << cycles;
+      out << " IPC:" << (cycles == 0 ? 0.0 : (double)instructions / cycles);
+      out << endl;
+      out << "Stall cycles:" << stalls << " Flushes:" << flushes;
+      out << " Flush cycles:" << flushes * MISPREDICT_PENALTY << endl;
+
+      out << setprecision(1);
+      map<uint64_t, BranchStats> sorted(branches.begin(), branches.end());
+      for (auto &b : sorted) {
+         out << "Branch PC:" << b.first << " correct:" << b.second.correct;
+         out << "/" << b.second.total << " accuracy:";
+         out << 100.0 * b.second.correct / b.second.total << "%" << endl;
+         correct += b.second.correct;
+         total += b.second.total;
+      }
+      out << "Predictor accuracy:";
+      out << (total == 0 ? 0.0 : 100.0 * correct / total) << "%" << endl;
+   }
+};
+
+/*
+   A Program is a decoded object file in Logisim's "v2.0 raw" format. The
+   words are kept as segments: literal segments point into the words
+   vector, and fill segments hold a run-length "N*XX" entry as a single
+   word repeated N times, so large zero-filled images stay small.
+   A loaded Program is never modified, so several simulations can share
+   the same one.
+*/
+class Program {
+private:
+   struct Segment {
+      uint64_t start;
+      uint64_t count;
+      bool fill;
+      size_t offset;
+   };
+
+   /* Runs up to this long are stored as literal words */
+   static const uint64_t FILL_THRESHOLD = 64;
+   static const uint64_t MAX_WORDS = 1ULL << 40;
+
+   vector<Segment> segments;
+   vector<uint8_t> words;
+   uint64_t length = 0;
+   uint64_t denseLength = 0;
+
+   /* Appends count copies of a word to the image */
+   void append(uint64_t count, uint8_t word) {
+      if (count > FILL_THRESHOLD) {
+         segments.push_back({length, count, true, words.size()});
+         words.push_back(word);
+         length += count;
+         return;
+      }
+
+      if (segments.empty() || segments.back().fill) {
+         segments.push_back({length, 0, false, words.size()});
+      }
+      words.insert(words.end(), count, word);
+      segments.back().count += count;
+      length += count;
+   }
+
+   /* Appends a single literal word */
+   void appendLiteral(uint8_t word) {
+      if (segments.empty() || segments.back().fill) {
+         segments.push_back({length, 0, false, words.size()});
+      }
+      words.push_back(word);
+      segments.back().count++;
+      length++;
+   }
+
+   /* Character classes and hex digit values used by the fast path */
+   enum { HEX_DIGIT = 1, SEPARATOR = 2 };
+
+   struct CharTable {
+      uint8_t kind[256] = {};
+      uint8_t value[256] = {};
+
+      CharTable() {
+         for (int c = 0; c < 256; c++) {
+            if (hexDigit(c) >= 0) {
+               kind[c] = HEX_DIGIT;
+               value[c] = hexDigit(c);
+            }
+         }
+         kind[(int)' '] = kind[(int)'\t'] = SEPARATOR;
+         kind[(int)'\r'] = kind[(int)'\n'] = SEPARATOR;
+      }
+   };
+
+   static const CharTable &charTable() {
+      static const CharTable table;
+      return table;
+   }
+
+   /* Returns the index in words of the word at an address */
+   size_t locate(uint64_t PC) const {
+      if (PC < denseLength) return PC;
+
+      size_t low = 0, high = segments.size() - 1;
+      while (low < high) {
+         size_t mid = (low + high + 1) / 2;
+         if (segments[mid].start <= PC) low = mid;
+         else high = mid - 1;
+      }
+
+      const Segment &s = segments[low];
+      return s.fill ? s.offset : s.offset + (PC - s.start);
+   }
+
+   /* Formats a load error with the position it was found at */
+   static string positionError(uint64_t line, uint64_t column, string what) {
+      return "<Line <" + to_string(line) + "> column <" + to_string(column)
+         + ">: " + what + ">";
+   }
+
+public:
+   /* Returns the number of words in the image */
+   uint64_t size() const { return length; }
+
+   /* Returns the decoded instruction at an address, add r0 r0 r0 past */
+   /* the end of the image */
+   DecodedInstruction operator[](uint64_t PC) const {
+      if (PC >= length) return DecodedInstruction(0);
+      return DecodedInstruction(words[locate(PC)]);
+   }
+
+   /* Returns the disassembly of the instruction at an address, which is */
+   /* empty past the end of the image */
+   DisassemblerInstructions disassemble(uint64_t PC) const {
+      if (PC >= length) return DisassemblerInstructions("");
+
+      InstructionMemory ins(words[locate(PC)]);
+      return DisassemblerInstructions(ins.toString());
+   }
+
+   /*
+      Reads a "v2.0 raw" image. After the header line, entries are hex
+      words separated by any whitespace, in either case, or run-length
+      entries "N*XX" with a decimal count. A '#' starts a comment that
+      runs to the end of the line.
+      The input is parsed in place from a fixed buffer, so nothing is
+      allocated per entry. The common two-digit "XX" literal followed by
+      whitespace is taken three characters at a time through a lookup
+      table; everything else goes through the character state machine.
+      On an invalid entry it returns false with the line and column in
+      the error message.
+   */
+   bool load(istream &inputFile, string &error) {
+      static const int BUFFER_SIZE = 1 << 16;
+      char buffer[BUFFER_SIZE];
+      const char *header = "v2.0 raw";
+      string badHeader = "";
+      int headerIndex = 0;
+      bool inHeader = true, headerMatches = true, inComment = false;
+      bool inEntry = false, sawStar = false, countIsDecimal = true;
+      uint64_t line = 1, column = 0, entryLine = 0, entryColumn = 0;
+      uint64_t count = 0, value = 0;
+      int digits = 0;
+      const CharTable &table = charTable();
+      const uint8_t *bytes = (const uint8_t*)buffer;
+
+      /* Most words take three bytes, so size the image from the stream */
+      streampos start = inputFile.tellg();
+      if (start != streampos(-1) && inputFile.seekg(0, ios::end)) {
+         streampos end = inputFile.tellg();
+         inputFile.seekg(start);
+         if (end > start) words.reserve((end - start) / 3);
+      }
+      inputFile.clear();
+
+      while (inputFile) {
+         inputFile.read(buffer, BUFFER_SIZE);
+         streamsize got = inputFile.gcount();
+
+         for (streamsize i = 0; i < got; i++) {
+            if (!inHeader && !inEntry && !inComment) {
+               while (i + 2 < got && length < MAX_WORDS &&
+                  (table.kind[bytes[i]] & table.kind[bytes[i + 1]] &
+                  HEX_DIGIT) && (table.kind[bytes[i + 2]] & SEPARATOR)) {
+                  appendLiteral(table.value[bytes[i]] << 4 |
+                     table.value[bytes[i + 1]]);
+
+                  bool newline = bytes[i + 2] == '\n';
+                  line += newline;
+                  column = newline ? 0 : column + 3;
+                  i += 3;
+               }
+               if (i >= got) break;
+            }
+
+            char c = buffer[i];
+            column++;
+
+            /* The first line has to be exactly the header */
+            if (inHeader) {
+               if (c == '\n') {
+                  if (!headerMatches || header[headerIndex] != '\0') {
+                     error = "Invalid header file <" + badHeader + ">";
+                     return false;
+                  }
+                  inHeader = false;
+                  line++;
+                  column = 0;
+               }
+               else {
+                  if (badHeader.size() < 80) badHeader += c;
+                  if (c == '\r' && header[headerIndex] == '\0') continue;
+                  if (header[headerIndex] == '\0' || header[headerIndex] != c) {
+                     headerMatches = false;
+                  }
+                  else headerIndex++;
+               }
+               continue;
+            }
+
+            int digit = hexDigit(c);
+            bool separator = c == ' ' || c == '\t' || c == '\r' ||
+               c == '\n' || c == '#';
+
+            if (inComment && c != '\n') continue;
+
+            if (separator) {
+               if (inEntry && !finishEntry(sawStar, digits, count, value,
+                  entryLine, entryColumn, error)) {
+                  return false;
+               }
+               inEntry = false;
+               inComment = c == '#' || (inComment && c != '\n');
+               if (c == '\n') {
+                  line++;
+                  column = 0;
+               }
+               continue;
+            }
+
+            if (!inEntry) {
+               inEntry = true;
+               sawStar = false;
+               countIsDecimal = true;
+               count = value = 0;
+               digits = 0;
+               entryLine = line;
+               entryColumn = column;
+            }
+
+            if (c == '*') {
+               if (sawStar || digits == 0 || !countIsDecimal) {
+                  error = positionError(line, column, "invalid run length");
+                  return false;
+               }
+               if (count == 0 || count > MAX_WORDS) {
+                  error = positionError(entryLine, entryColumn,
+                     "run length out of range");
+                  return false;
+               }
+               sawStar = true;
+               value = 0;
+               digits = 0;
+            }
+            else if (digit >= 0) {
+               if (!sawStar) {
+                  if (c > '9') countIsDecimal = false;
+                  else if (count <= MAX_WORDS) count = count * 10 + digit;
+               }
+               if (value <= 0xFF) value = value * 16 + digit;
+               digits++;
+            }
+            else {
+               error = positionError(line, column,
+                  string("unexpected character '") + c + "'");
+               return false;
+            }
+         }
+      }
+
+      if (inHeader && badHeader != "" &&
+         (!headerMatches || header[headerIndex] != '\0')) {
+         error = "Invalid header file <" + badHeader + ">";
+         return false;
+      }
+      if (inEntry && !finishEntry(sawStar, digits, count, value, entryLine,
+         entryColumn, error)) {
+         return false;
+      }
+
+      denseLength = !segments.empty() && !segments[0].fill ?
+         segments[0].count : 0;
+      return true;
+   }
+
+   /* Validates the entry that just ended and appends it to the image */
+   bool finishEntry(bool sawStar, int digits, uint64_t count,
+      uint64_t value, uint64_t line, uint64_t column, string &error) {
+      if (digits == 0) {
+         error = positionError(line, column, "run length without a value");
+         return false;
+      }
+      if (value > 0xFF) {
+         error = positionError(line, column, "value does not fit in 8 bits");
+         return false;
+      }
+      if (length + (sawStar ? count : 1) > MAX_WORDS) {
+         error = positionError(line, column, "image is too large");
+         return false;
+      }
+
+      append(sawStar ? count : 1, value);
+      return true;
+   }
+
+   /* Returns the value of a hexadecimal digit, or -1 */
+   static int hexDigit(char c) {
+      if (c >= '0' && c <= '9') return c - '0';
+      if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+      if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+      return -1;
+   }
+};
+
 /*
    The simulator object compiles an input file by converting hex machine
    codes into 8-bit binary code, and uses the 8-bit binary instruction
    to convert it into assembly code.
+   All of its output goes to the stream it was created with, which is
+   standard output unless the simulation runs inside the daemon.
 */
 class Simulator{
 private:
    char zFlag = '0';
    uint8_t registers[4] = {0, 0, 0, 0};
-   vector<InstructionMemory> instructions;
-   vector<DisassemblerInstructions> decodes;
+   shared_ptr<const Program> program;
+   ostream &out;
+   function<bool()> stopCheck;
+   bool stopRequested = false;
+   uint64_t steps = 0;
+
+   /* Blocks longer than this are split so straight-line code stays cheap */
+   static const int MAX_BLOCK_LENGTH = 64;
+
+   /* Returns true once the output has failed or the caller asked to stop */
+   bool stopped() {
+      if (!out || stopRequested) return true;
+      if (stopCheck && (++steps & 0xFFFF) == 0) stopRequested = stopCheck();
+      return stopRequested;
+   }
    
 public:
-   void compileFile(string pathname, int numOfCycle, bool show_disassembly) {
+   Simulator(ostream &out = cout) : out(out) {}
+
+   /* Sets a check that can end a run early, called every 65536 steps */
+   void setStopCheck(function<bool()> check) { stopCheck = check; }
+
+   void compileFile(string pathname, long long numOfCycle,
+      bool show_disassembly, bool block_cache = false) {
+      run(loadFile(pathname), numOfCycle, show_disassembly, block_cache);
+   }
+
+   /* Reads and decodes an object file, exiting on an invalid entry */
+   shared_ptr<const Program> loadFile(string pathname) {
       ifstream inputFile;
+      shared_ptr<Program> loaded = make_shared<Program>();
 
       inputFile.open(pathname, ios::in);
 
       if (inputFile) {
-         string line;
-         int index = 0;
-
-         while (getline(inputFile, line)) {
-            if (index == 0 && line != "v2.0 raw") {
-               cout << "Invalid header file <"<< line <<">" << endl;
-               exit(0);
-            }
+         string error;
 
-            if (line != "v2.0 raw") {
-               InstructionMemory ins(hexToBin(line[0])+hexToBin(line[1]));
-               instructions.push_back(ins);
-               DisassemblerInstructions dec(ins.toString());
-               decodes.push_back(dec);
-            }
-            index = 1;
+         if (!loaded->load(inputFile, error)) {
+            out << error << endl;
+            exit(0);
          }
       }
       else {
-         cout << "<File <" << pathname << "> not found>" << endl;
+         out << "<File <" << pathname << "> not found>" << endl;
       }
+      return loaded;
+   }
+
+   /* Runs an already decoded program from a reset state */
+   void run(shared_ptr<const Program> loaded, long long numOfCycle,
+      bool show_disassembly, bool block_cache) {
+      reset();
+      program = loaded;
+      const Program &code = *program;
 
-      int cycle = 1, PC = 0;
-      int loop = 0;
+      /* The disassembly listing needs every cycle, so it is not cached */
+      if (block_cache && !show_disassembly) {
+         runBlockCached(numOfCycle);
+         return;
+      }
+
+      long long cycle = 1;
+      uint64_t PC = 0;
 
       /* Displays cycles as well as disassembly code */
-      while (PC < decodes.size()) {
+      while (PC < code.size() && !stopped()) {
          if (cycle <= numOfCycle) {
-            computeInstruction(decodes[PC], PC, loop);
+            uint64_t current = PC;
+
+            computeInstruction(code[current], PC);
             displayStates(cycle, PC);
             
             if (show_disassembly) {
-               int index = loop > PC? loop : PC - 1;
-               displayDisassembly(decodes[index].getDI());
-               loop = 0;
+               displayDisassembly(code.disassemble(current).getDI());
             }
          }
          else { break; }
@@ -180,67 +844,168 @@ public:
       }
    }
 
-   /* Takes care of intruction mnemonic operations */
-   void computeInstruction(DisassemblerInstructions instruction,
-      int &PC, int &loop ) {
-      vector<string> word = instruction.getDI();
-      
-      if (word[0] == "not") {
-         int dest = customCharToInt(word[1][1]);
-         int rn = customCharToInt(word[2][1]);
+   /*
+      Runs the program one basic block at a time. Each block is looked up
+      in the block cache with the current state and, on a hit, the cached
+      exit state is applied in a single step. Misses are interpreted and
+      recorded. Only the final state and the cache statistics are shown.
+   */
+   void runBlockCached(long long numOfCycle) {
+      const Program &code = *program;
+      BlockCache cache(4096);
+      long long cycle = 0;
+      uint64_t PC = 0;
+
+      while (PC < code.size() && cycle < numOfCycle && !stopped()) {
+         uint64_t start = PC;
+         uint64_t state = packState();
+         BlockCache::Entry *e = cache.find(start, state);
+
+         if (e != nullptr && e->cycles <= numOfCycle - cycle) {
+            unpackState(e->exitState);
+            PC = e->exitPC;
+            cycle += e->cycles;
+            continue;
+         }
+
+         /* Interpret the block, stopping early if the cycles run out */
+         int length = 0;
+         bool ended = false;
+
+         while (PC < code.size() && cycle < numOfCycle) {
+            bool branch = code[PC].op == 3;
 
-         registers[dest] = ~registers[rn];
-         zFlag = registers[dest] == 0? '1' : '0';
+            computeInstruction(code[PC], PC);
+            cycle++;
+            length++;
+
+            if (branch || PC >= code.size() || 
+               length == MAX_BLOCK_LENGTH) {
+               ended = true;
+               break;
+            }
+         }
+
+         if (ended && e == nullptr) {
+            cache.insert(start, state, PC, packState(), length);
+         }
+      }
+
+      if (cycle > 0) displayStates(cycle, PC);
+      cache.displayStats(out);
+   }
+
+   /*
+      Runs the program from a reset state on the functional model and
+      feeds every retired instruction to a PipelineModel. numOfCycle
+      limits the number of instructions, and only the final state and the
+      timing are shown.
+   */
+   void runPipelined(shared_ptr<const Program> loaded, long long numOfCycle,
+      string predictorName, bool forwarding) {
+      reset();
+      program = loaded;
+      const Program &code = *program;
+      PipelineModel pipeline(predictorName, forwarding);
+      long long retired = 0;
+      uint64_t PC = 0;
+
+      while (PC < code.size() && retired < numOfCycle && !stopped()) {
+         uint64_t current = PC;
+         bool taken = zFlag == '0';
+
+         computeInstruction(code[current], PC);
+         pipeline.retire(current, code[current], taken);
+         retired++;
       }
-      else if(word[0] == "bnz") {
+
+      if (retired > 0) displayStates(retired, PC);
+      pipeline.displayStats(out);
+   }
+
+   /* Clears Z and R0-R3 before a new run */
+   void reset() {
+      zFlag = '0';
+      for (int i = 0; i < 4; i++) registers[i] = 0;
+   }
+
+   /* Packs Z and R0-R3 into a single integer used as a cache key */
+   uint64_t packState() {
+      uint64_t state = zFlag == '1' ? 1 : 0;
+
+      for (int i = 0; i < 4; i++) {
+         state |= (uint64_t)registers[i] << (8 * (i + 1));
+      }
+      return state;
+   }
+
+   /* Restores Z and R0-R3 from a packed state */
+   void unpackState(uint64_t state) {
+      zFlag = (state & 1) ? '1' : '0';
+
+      for (int i = 0; i < 4; i++) {
+         registers[i] = (state >> (8 * (i + 1))) & 0xFF;
+      }
+   }
+
+   /* Takes care of intruction mnemonic operations */
+   void computeInstruction(const DecodedInstruction &instruction,
+      uint64_t &PC) {
+      if (instruction.op == 2) {
+         registers[instruction.rd] = ~registers[instruction.rn];
+         zFlag = registers[instruction.rd] == 0? '1' : '0';
+      }
+      else if(instruction.op == 3) {
          /* If in a loop, jump to targeted address */
          /* If zFlag is set, break loop and jump to next address */
          if (zFlag == '1') {
             PC = PC + 1;
-            loop = false;
          }
          else {
-            loop = PC;
-            PC = stoi(word[1]);
+            PC = instruction.target;
          }
          return;
       }
       else {
-         int dest = customCharToInt(word[1][1]);
-         int rn = customCharToInt(word[2][1]);
-         int rm = customCharToInt(word[3][1]);
+         uint8_t rn = registers[instruction.rn];
+         uint8_t rm = registers[instruction.rm];
 
-         if (word[0] == "add") {
-            registers[dest] = registers[rn] + registers[rm];
+         if (instruction.op == 0) {
+            registers[instruction.rd] = rn + rm;
          }
          else {
-            registers[dest] = registers[rn] & registers[rm];
+            registers[instruction.rd] = rn & rm;
          }
-         zFlag = registers[dest] == 0? '1' : '0';
+         zFlag = registers[instruction.rd] == 0? '1' : '0';
       }
       PC++;
    }
 
    /* Displays each cycle with the different states */
-   void displayStates(int cycle, int PC) {
+   void displayStates(long long cycle, uint64_t PC) {
       stringstream r3("");
       r3 << hex << (int)registers[3];
-      cout << "Cycle:" <<to_string(cycle)<< " States:PC:" << disNum(PC);
-      cout << " Z:" << zFlag;
-      cout << " R0:" <<disNum(registers[0])<< " R1:" << disNum(registers[1]);
-      cout << " R2:" <<disNum(registers[2])<< " R3:" <<hex<< r3.str();
-      cout << endl;
+      out << "Cycle:" <<to_string(cycle)<< " States:PC:" << disPC(PC);
+      out << " Z:" << zFlag;
+      out << " R0:" <<disNum(registers[0])<< " R1:" << disNum(registers[1]);
+      out << " R2:" <<disNum(registers[2])<< " R3:" <<hex<< r3.str();
+      out << endl;
    }
 
    /* Displays a vector of disassemly as a string line */
    void displayDisassembly(vector<string> word) {
-      cout << "Disassembly: ";
+      out << "Disassembly: ";
       for (int i = 0; i < 4; i++) {
          if (word.size() != 0) {
-            cout << word[i] << " ";
+            out << word[i] << " ";
          }
       }
-      cout << endl << endl;
+      out << endl << endl;
+   }
+
+   /* Returns the PC as a string with a leading 0 below 10, at full width */
+   string disPC(uint64_t PC) {
+      return PC < 10 ? '0' + to_string(PC) : to_string(PC);
    }
 
    /* Returns single digits as string with leading 0's, 255 as FF */
@@ -256,54 +1021,485 @@ public:
          return to_string(num);
       }
    }
+};
+
+/* The fiscsimd daemon and its client use Unix sockets, so Linux only */
+#ifdef __linux__
+
+/* Returns the 64-bit FNV-1a hash of a program's contents */
+uint64_t contentHash(const string &content) {
+   uint64_t hash = 0xCBF29CE484222325ULL;
+
+   for (unsigned char c : content) {
+      hash ^= c;
+      hash *= 0x100000001B3ULL;
+   }
+   return hash;
+}
+
+/*
+   The ProgramCache keeps the most recently used decoded programs of the
+   daemon, keyed by the hash of the object file contents. The contents
+   are kept as well and compared on every hit, so two files whose hashes
+   collide never share a program. When it is full the least recently
+   used program is dropped. It is shared by all of the worker threads,
+   so every operation takes the lock.
+*/
+class ProgramCache {
+private:
+   struct Entry {
+      uint64_t key;
+      string content;
+      shared_ptr<const Program> program;
+   };
+
+   size_t capacity;
+   list<Entry> order;
+   unordered_map<uint64_t, list<Entry>::iterator> entries;
+   mutex lock;
+
+public:
+   ProgramCache(size_t capacity) : capacity(capacity) {}
+
+   /* Returns the cached program and marks it as most recently used */
+   shared_ptr<const Program> find(uint64_t key, const string &content) {
+      lock_guard<mutex> guard(lock);
+      auto it = entries.find(key);
+
+      if (it == entries.end() || it->second->content != content) {
+         return nullptr;
+      }
+      order.splice(order.begin(), order, it->second);
+      return it->second->program;
+   }
+
+   /*
+      Adds a program, replacing a colliding one with the same key and
+      dropping the least recently used one when full.
+   */
+   void insert(uint64_t key, const string &content,
+      shared_ptr<const Program> program) {
+      lock_guard<mutex> guard(lock);
+      auto it = entries.find(key);
+
+      if (it != entries.end()) {
+         order.erase(it->second);
+         entries.erase(it);
+      }
+
+      order.push_front({key, content, program});
+      entries[key] = order.begin();
+
+      if (order.size() > capacity) {
+         entries.erase(order.back().key);
+         order.pop_back();
+      }
+   }
+};
+
+/*
+   A SocketStreamBuf lets the Simulator write straight to a client socket,
+   so traces are streamed back while the simulation is still running.
+*/
+class SocketStreamBuf : public streambuf {
+private:
+   int fd;
+   char buffer[4096];
+
+   bool flushBuffer() {
+      char *data = pbase();
+      size_t size = pptr() - pbase();
+
+      while (size > 0) {
+         ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+         if (sent <= 0) return false;
+         data += sent;
+         size -= sent;
+      }
+      setp(buffer, buffer + sizeof(buffer));
+      return true;
+   }
+
+protected:
+   int overflow(int c) override {
+      if (!flushBuffer()) return EOF;
+      if (c != EOF) {
+         *pptr() = c;
+         pbump(1);
+      }
+      return c == EOF ? 0 : c;
+   }
+
+   int sync() override { return flushBuffer() ? 0 : -1; }
+
+public:
+   SocketStreamBuf(int fd) : fd(fd) { setp(buffer, buffer + sizeof(buffer)); }
+};
+
+/*
+   A ServerRequest is one request of the daemon. Its bytes are collected
+   as they arrive, and once the header line and the whole payload are in
+   it is parsed and handed to a worker thread.
+*/
+struct ServerRequest {
+   int fd = -1;
+   string data = "";
+   chrono::steady_clock::time_point deadline;
+   bool valid = false;
+   string header = "";
+   long long cycles = 0;
+   bool showDisassembly = false;
+   bool blockCache = false;
+   string predictor = "";
+   bool forwarding = true;
+   string kind = "";
+   string payload = "";
+
+   /* Returns true once the request is complete, valid or not */
+   bool complete() {
+      size_t end = data.find('\n');
+
+      if (end == string::npos) {
+         if (data.size() <= MAX_HEADER) return false;
+         header = data.substr(0, 80);
+         return true;
+      }
+
+      string command;
+      size_t length = 0;
+      int d = 0, b = 0, f = 0;
+
+      header = data.substr(0, end);
+      istringstream fields(header);
+      fields >> command >> cycles >> d >> b >> predictor >> f;
+      fields >> kind >> length;
+
+      if (!fields || command != "RUN" || (kind != "PATH" && kind != "DATA")
+         || length > MAX_PAYLOAD) {
+         return true;
+      }
+      if (predictor != "-" && makePredictor(predictor) == nullptr) {
+         return true;
+      }
+      if (data.size() - end - 1 < length) return false;
+
+      showDisassembly = d;
+      blockCache = b;
+      forwarding = f;
+      payload = data.substr(end + 1, length);
+      valid = true;
+      return true;
+   }
 
-   /* Converts characters 0, 1, 2, 3 to their respective integer values */
-   int customCharToInt(char c) {
-      switch (c) {
-      case '0':
-         return 0;
-      case '1':
-         return 1;
-      case '2':
-         return 2;
-      case '3':
-         return 3;
-      default:
-         return -1;
+   static constexpr size_t MAX_HEADER = 4096;
+   static constexpr size_t MAX_PAYLOAD = 64u << 20;
+};
+
+/*
+   The SimulationServer is the fiscsimd mode. It listens on a Unix domain
+   socket and each connection carries one request:
+
+      RUN <cycles> <-d 0|1> <-b 0|1> <-p predictor|-> <forwarding 0|1>
+         <PATH|DATA> <length>\n<payload>
+
+   The header is a single line. The payload is either the path of an
+   object file or its contents. The
+   decoded program is looked up in the ProgramCache by content hash, and
+   the simulation output is streamed back before the connection closes.
+   Requests are read on the accepting thread with poll, so a client that
+   never sends anything only holds its own connection until it times
+   out. Complete requests are run by a fixed pool of worker threads.
+*/
+class SimulationServer {
+private:
+   static constexpr int REQUEST_TIMEOUT_MS = 5000;
+   static constexpr int SEND_TIMEOUT_MS = 5000;
+   static constexpr size_t MAX_READING = 256;
+   static constexpr size_t MAX_PENDING = 256;
+
+   string socketPath;
+   ProgramCache cache;
+   queue<ServerRequest> pending;
+   mutex lock;
+   condition_variable ready;
+
+   /* Waits for complete requests and serves them one at a time */
+   void worker() {
+      while (true) {
+         ServerRequest request;
+         {
+            unique_lock<mutex> guard(lock);
+            ready.wait(guard, [this] { return !pending.empty(); });
+            request = pending.front();
+            pending.pop();
+         }
+         handle(request);
+         close(request.fd);
       }
    }
 
-   /* Converts an hexadecimal to binay */
-   string hexToBin(char hex) {
-      map<char, int> hexVal = {
-         {'A', 10}, {'B', 11}, {'C', 12},
-         {'D', 13}, {'E', 14}, {'F', 15}
-      };
-      string bin = "";
-      int val = 0;
+   /* Runs one request and streams the output to the client */
+   void handle(const ServerRequest &request) {
+      SocketStreamBuf buf(request.fd);
+      ostream out(&buf);
+
+      if (!request.valid) {
+         out << "<Invalid request <" << request.header << ">>" << endl;
+         return;
+      }
+
+      string content;
+      if (request.kind == "PATH") {
+         ifstream inputFile(request.payload, ios::in | ios::binary);
+
+         if (!inputFile) {
+            out << "<File <" << request.payload << "> not found>" << endl;
+            return;
+         }
+         stringstream data;
+         data << inputFile.rdbuf();
+         content = data.str();
+      }
+      else {
+         content = request.payload;
+      }
+
+      uint64_t key = contentHash(content);
+      shared_ptr<const Program> program = cache.find(key, content);
+
+      if (program == nullptr) {
+         shared_ptr<Program> loaded = make_shared<Program>();
+         istringstream inputFile(content);
+         string error;
+
+         if (!loaded->load(inputFile, error)) {
+            out << error << endl;
+            return;
+         }
+         cache.insert(key, content, loaded);
+         program = loaded;
+      }
+
+      /* Give up on the run once the client has hung up */
+      Simulator simu(out);
+      int fd = request.fd;
+      simu.setStopCheck([fd] {
+         pollfd p = {fd, 0, 0};
+         return poll(&p, 1, 0) > 0 && (p.revents & (POLLHUP | POLLERR));
+      });
 
-      if (hexVal.find(hex) != hexVal.end()) {
-         val = hexVal[hex];
+      if (request.predictor != "-") {
+         simu.runPipelined(program, request.cycles, request.predictor,
+            request.forwarding);
       }
       else {
-         val = stoi(to_string(hex));
-         char* newHex = &hex;
-         sscanf(newHex, "%d", &val);
+         simu.run(program, request.cycles, request.showDisassembly,
+            request.blockCache);
       }
+      out.flush();
+   }
+
+   /* Queues a complete request, returns false if the queue is full */
+   bool dispatch(ServerRequest &request) {
+      lock_guard<mutex> guard(lock);
+
+      if (pending.size() >= MAX_PENDING) return false;
+      pending.push(request);
+      ready.notify_one();
+      return true;
+   }
+
+public:
+   SimulationServer(string socketPath) : socketPath(socketPath), cache(64) {}
+
+   /* Binds the socket and serves requests until the process is killed */
+   void serve() {
+      int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+      sockaddr_un address = {};
+
+      address.sun_family = AF_UNIX;
+      if (listener < 0 || socketPath.size() >= sizeof(address.sun_path)) {
+         cout << "<Invalid socket path <" << socketPath << ">>" << endl;
+         exit(1);
+      }
+      strcpy(address.sun_path, socketPath.c_str());
+
+      /* Only clear out a stale socket, never a regular file */
+      struct stat info;
+      bool stale = lstat(socketPath.c_str(), &info) == 0;
+      if (stale && !S_ISSOCK(info.st_mode)) {
+         cout << "<Could not listen on <" << socketPath << ">>" << endl;
+         exit(1);
+      }
+      if (stale) unlink(socketPath.c_str());
+
+      if (bind(listener, (sockaddr*)&address, sizeof(address)) < 0 ||
+         listen(listener, 64) < 0) {
+         cout << "<Could not listen on <" << socketPath << ">>" << endl;
+         exit(1);
+      }
+
+      signal(SIGPIPE, SIG_IGN);
+
+      /* Workers never wait on reads and their sends time out, so the */
+      /* pool only has to cover the simulations themselves */
+      unsigned workers = max(4u, thread::hardware_concurrency());
+      for (unsigned i = 0; i < workers; i++) {
+         thread(&SimulationServer::worker, this).detach();
+      }
+
+      vector<ServerRequest> reading;
+      char buffer[65536];
+
+      while (true) {
+         vector<pollfd> fds = {{listener, POLLIN, 0}};
+         for (auto &r : reading) fds.push_back({r.fd, POLLIN, 0});
+
+         if (poll(fds.data(), fds.size(), 250) < 0) continue;
+
+         auto now = chrono::steady_clock::now();
+         vector<ServerRequest> still;
+
+         for (size_t i = 0; i < reading.size(); i++) {
+            ServerRequest &r = reading[i];
+            bool closed = false;
+
+            if (fds[i + 1].revents != 0) {
+               ssize_t got = recv(r.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+               if (got > 0) r.data.append(buffer, got);
+               else if (got == 0 || (errno != EAGAIN && errno != EINTR)) {
+                  closed = true;
+               }
+            }
 
-      while (val != 0) {
-         bin = to_string(val % 2) + bin;
-         val /= 2;
+            if (!closed && r.complete()) {
+               if (!dispatch(r)) {
+                  const char *busy = "<Server is busy>\n";
+                  send(r.fd, busy, strlen(busy), MSG_DONTWAIT | MSG_NOSIGNAL);
+                  close(r.fd);
+               }
+            }
+            else if (closed || now > r.deadline) {
+               close(r.fd);
+            }
+            else {
+               still.push_back(r);
+            }
+         }
+         reading.swap(still);
+
+         if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0) continue;
+
+            if (reading.size() >= MAX_READING) {
+               close(fd);
+               continue;
+            }
+
+            timeval timeout = {SEND_TIMEOUT_MS / 1000, 0};
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            ServerRequest request;
+            request.fd = fd;
+            request.deadline = now + chrono::milliseconds(REQUEST_TIMEOUT_MS);
+            reading.push_back(request);
+         }
       }
-      while (bin.size() < 4) { bin = '0' + bin; }
-      return bin;
    }
 };
 
+/*
+   Sends one simulation request to a running fiscsimd and copies the
+   streamed output to standard output. The object file is sent by its
+   absolute path, or by contents when send_contents is set.
+*/
+void runClient(string socketPath, string pathname, long long cycles,
+   bool show_disassembly, bool block_cache, string predictor,
+   bool forwarding, bool send_contents) {
+   int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   sockaddr_un address = {};
+
+   address.sun_family = AF_UNIX;
+   if (fd < 0 || socketPath.size() >= sizeof(address.sun_path)) {
+      cout << "<Invalid socket path <" << socketPath << ">>" << endl;
+      exit(1);
+   }
+   strcpy(address.sun_path, socketPath.c_str());
+
+   if (connect(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+      cout << "<Could not connect to <" << socketPath << ">>" << endl;
+      exit(1);
+   }
+
+   string payload;
+   if (send_contents) {
+      ifstream inputFile(pathname, ios::in | ios::binary);
+
+      if (!inputFile) {
+         cout << "<File <" << pathname << "> not found>" << endl;
+         exit(0);
+      }
+      stringstream data;
+      data << inputFile.rdbuf();
+      payload = data.str();
+   }
+   else {
+      char resolved[PATH_MAX];
+      payload = realpath(pathname.c_str(), resolved) ? resolved : pathname;
+   }
+
+   string request = "RUN " + to_string(cycles) + " ";
+   request += to_string(show_disassembly) + " " + to_string(block_cache);
+   request += " " + (predictor == "" ? string("-") : predictor);
+   request += " " + to_string(forwarding);
+   request += send_contents ? " DATA " : " PATH ";
+   request += to_string(payload.size()) + "\n" + payload;
+
+   const char *data = request.data();
+   size_t size = request.size();
+   while (size > 0) {
+      ssize_t sent = write(fd, data, size);
+      if (sent <= 0) {
+         cout << "<Lost connection to <" << socketPath << ">>" << endl;
+         exit(1);
+      }
+      data += sent;
+      size -= sent;
+   }
+   shutdown(fd, SHUT_WR);
+
+   char buffer[4096];
+   ssize_t got;
+   while ((got = read(fd, buffer, sizeof(buffer))) > 0) {
+      cout.write(buffer, got);
+   }
+   cout.flush();
+   close(fd);
+}
+
+#endif
+
 /* Output error message for invalid command inputs */
 void errorMessage() {
-   cout << "USAGE:  fiscsim  <object file> [cycles] [-l]\n";
+   cout << "USAGE:  fiscsim  <object file> [cycles] [-d] [-b]\n";
+   cout << "        fiscsim  <object file> [cycles] -p <predictor> [-n]\n";
+#ifdef __linux__
+   cout << "        fiscsim  --serve <socket>\n";
+   cout << "        fiscsim  --connect <socket> <object file> [cycles] ";
+   cout << "[-d] [-b] [-p <predictor> [-n]] [-s]\n";
+#endif
    cout << "    -d : print disassembly listing with each cycle\n";
+   cout << "    -b : run with the basic block cache and only print the\n";
+   cout << "         final state and the cache hit rate\n";
+   cout << "    -p : run the 5-stage pipeline timing model with a static,\n";
+   cout << "         1bit, 2bit or gshare branch predictor\n";
+   cout << "    -n : disable forwarding in the pipeline timing model\n";
+#ifdef __linux__
+   cout << "    -s : send the object file contents instead of its path\n";
+   cout << "    --serve : run as the fiscsimd daemon on a Unix socket\n";
+#endif
    cout << "    if cycles are unspecified the CPU will run for 20 cycles\n";
    exit(1);
 }
@@ -319,39 +1515,94 @@ bool isNumber(string str) {
 
 int main(int argc, char** argv)
 {
-   int cycles = 20;
+   long long cycles = 20;
    bool showDisassembly = false;
+   bool blockCache = false;
+#ifdef __linux__
+   bool sendContents = false;
+#endif
+   bool forwarding = true;
+   string predictor = "";
+   bool cyclesSet = false;
+   string program = argv[0];
+   string socketPath = "";
+   int first = 1;
 
-   if (argc < 2 || argc > 4) {
+#ifdef __linux__
+   /* Started as fiscsimd, or with --serve, the simulator is a daemon */
+   if (program.size() >= 8 &&
+      program.substr(program.size() - 8) == "fiscsimd") {
+      if (argc != 2) errorMessage();
+      SimulationServer(argv[1]).serve();
+   }
+   if (argc >= 2 && string(argv[1]) == "--serve") {
+      if (argc != 3) errorMessage();
+      SimulationServer(argv[2]).serve();
+   }
+   if (argc >= 2 && string(argv[1]) == "--connect") {
+      if (argc < 4) errorMessage();
+      socketPath = argv[2];
+      first = 3;
+   }
+#endif
+
+   if (argc - first < 1) {
       errorMessage();
    }
 
-   if (argc == 3) {
-      string input = argv[2];
-      if (isNumber(input)) {
-         cycleccs = stoi(argv[2]);
+   for (int i = first + 1; i < argc; i++) {
+      string input = argv[i];
+
+      if (isNumber(input) && !input.empty() && !cyclesSet) {
+         try {
+            cycles = stoll(input);
+         }
+         catch (const out_of_range &) {
+            errorMessage();
+         }
+         cyclesSet = true;
       }
       else if (input == "-d") {
          showDisassembly = true;
       }
+      else if (input == "-b") {
+         blockCache = true;
+      }
+#ifdef __linux__
+      else if (input == "-s" && socketPath != "") {
+         sendContents = true;
+      }
+#endif
+      else if (input == "-p" && i + 1 < argc && predictor == "" &&
+         makePredictor(argv[i + 1]) != nullptr) {
+         predictor = argv[++i];
+      }
+      else if (input == "-n") {
+         forwarding = false;
+      }
       else errorMessage();
    }
-   else if(argc == 4) {
-      string input1 = argv[2], input2 = argv[3];
-      bool validIn = false;
 
-      if (isNumber(input1) || isNumber(input2)) {
-         cycles = isNumber(input1) ? stoi(input1) : stoi(input2);
-         validIn = true;
-      } 
-      
-      if (input1 == "-d" || input2 == "-d") {
-         showDisassembly = true;
-         validIn = true;
-      }
-      if(!validIn) { errorMessage(); }
+   /* The pipeline model prints its own summary instead of the trace */
+   if ((predictor != "" || !forwarding) && (predictor == "" ||
+      showDisassembly || blockCache)) {
+      errorMessage();
+   }
+
+#ifdef __linux__
+   if (socketPath != "") {
+      runClient(socketPath, argv[first], cycles, showDisassembly, blockCache,
+         predictor, forwarding, sendContents);
+      return 0;
    }
+#endif
 
    Simulator simu;
-   simu.compileFile(argv[1], cycles, showDisassembly);
+
+   if (predictor != "") {
+      simu.runPipelined(simu.loadFile(argv[first]), cycles, predictor,
+         forwarding);
+      return 0;
+   }
+   simu.compileFile(argv[first], cycles, showDisassembly, blockCache);
 }